@@ -0,0 +1,626 @@
+/*
+ * RPC and bulk benchmark for the Mercury (HG) and Margo layers of the GekkoFS
+ * installation. A server is forked on this machine and a client measures
+ * serial RPC latency, RPC rate with several RPCs in flight, and bulk pull
+ * bandwidth against it, for each of the given transports. Rows are printed
+ * as CSV in the same schema as bench-fabric, with the operation in the
+ * endpoint column, so the layers can be compared against each other.
+ *
+ * Usage: bench-rpc [-l hg|margo] [-x handler_xstreams] [-c concurrency]
+ *                  [-I iterations] [transport ...]
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include <margo.h>
+#include <mercury.h>
+#include <mercury_macros.h>
+
+#define BENCH_ADDR_MAX  256
+#define BENCH_BULK_MIN  (4 << 10)
+#define BENCH_BULK_MAX  (4 << 20)
+
+MERCURY_GEN_PROC(bench_bulk_in_t, ((hg_bulk_t)(bulk))((hg_uint64_t)(size)))
+
+struct bench_opts {
+    const char *layer;
+    int xstreams;
+    int concurrency;
+    int iterations;
+};
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_row(const char *layer, const char *transport, const char *op,
+    size_t bytes, int iterations, double elapsed)
+{
+    double usec = elapsed * 1e6 / iterations;
+    double mbps = bytes ? (double) bytes * iterations / elapsed / 1e6 : 0.0;
+
+    printf("%s,%s,%s,%zu,%d,%.2f,%.2f\n", layer, transport, op, bytes,
+        iterations, usec, mbps);
+    fflush(stdout);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Mercury (HG) layer                                                        */
+/*---------------------------------------------------------------------------*/
+
+struct hg_bench {
+    hg_class_t *hg_class;
+    hg_context_t *context;
+    hg_id_t noop_id;
+    hg_id_t bulk_id;
+    hg_id_t shutdown_id;
+    int completed;
+    int issued;
+    int target;
+    int done;
+    int failed;
+    hg_addr_t addr;
+    bench_bulk_in_t bulk_in;
+};
+
+struct hg_bulk_state {
+    hg_handle_t handle;
+    hg_bulk_t local;
+    void *buf;
+    bench_bulk_in_t in;
+};
+
+/* Runs callbacks and progress until *flag reaches target. */
+static int
+hg_bench_progress(struct hg_bench *b, int *flag, int target)
+{
+    while (*flag < target && !b->failed) {
+        unsigned int actual = 0;
+        hg_return_t ret;
+
+        do {
+            ret = HG_Trigger(b->context, 0, 1, &actual);
+        } while (ret == HG_SUCCESS && actual && *flag < target);
+        if (*flag >= target)
+            break;
+        ret = HG_Progress(b->context, 100);
+        if (ret != HG_SUCCESS && ret != HG_TIMEOUT)
+            return -1;
+    }
+    return b->failed ? -1 : 0;
+}
+
+static hg_return_t
+hg_respond_cb(const struct hg_cb_info *info)
+{
+    struct hg_bench *b = info->arg;
+
+    if (b)
+        b->done = 1;
+    return HG_SUCCESS;
+}
+
+static hg_return_t
+hg_noop_handler(hg_handle_t handle)
+{
+    HG_Respond(handle, hg_respond_cb, NULL, NULL);
+    HG_Destroy(handle);
+    return HG_SUCCESS;
+}
+
+static hg_return_t
+hg_shutdown_handler(hg_handle_t handle)
+{
+    const struct hg_info *info = HG_Get_info(handle);
+    struct hg_bench *b = HG_Registered_data(info->hg_class, info->id);
+
+    HG_Respond(handle, hg_respond_cb, b, NULL);
+    HG_Destroy(handle);
+    return HG_SUCCESS;
+}
+
+static hg_return_t
+hg_bulk_pulled_cb(const struct hg_cb_info *info)
+{
+    struct hg_bulk_state *s = info->arg;
+
+    HG_Bulk_free(s->local);
+    free(s->buf);
+    HG_Free_input(s->handle, &s->in);
+    HG_Respond(s->handle, hg_respond_cb, NULL, NULL);
+    HG_Destroy(s->handle);
+    free(s);
+    return HG_SUCCESS;
+}
+
+static hg_return_t
+hg_bulk_handler(hg_handle_t handle)
+{
+    const struct hg_info *info = HG_Get_info(handle);
+    struct hg_bulk_state *s = calloc(1, sizeof(*s));
+    hg_size_t size;
+
+    s->handle = handle;
+    HG_Get_input(handle, &s->in);
+    size = s->in.size;
+    s->buf = malloc(size);
+    HG_Bulk_create(info->hg_class, 1, &s->buf, &size, HG_BULK_WRITE_ONLY,
+        &s->local);
+    HG_Bulk_transfer(info->context, hg_bulk_pulled_cb, s, HG_BULK_PULL,
+        info->addr, s->in.bulk, 0, s->local, 0, size, HG_OP_ID_IGNORE);
+    return HG_SUCCESS;
+}
+
+static int
+hg_bench_init(struct hg_bench *b, const char *transport, hg_bool_t listen)
+{
+    memset(b, 0, sizeof(*b));
+    b->hg_class = HG_Init(transport, listen);
+    if (!b->hg_class)
+        return -1;
+    b->context = HG_Context_create(b->hg_class);
+    if (!b->context)
+        return -1;
+    b->noop_id = HG_Register_name(b->hg_class, "bench_noop", NULL, NULL,
+        hg_noop_handler);
+    b->bulk_id = HG_Register_name(b->hg_class, "bench_bulk",
+        hg_proc_bench_bulk_in_t, NULL, hg_bulk_handler);
+    b->shutdown_id = HG_Register_name(b->hg_class, "bench_shutdown", NULL,
+        NULL, hg_shutdown_handler);
+    HG_Register_data(b->hg_class, b->shutdown_id, b, NULL);
+    return 0;
+}
+
+static void
+hg_bench_finalize(struct hg_bench *b)
+{
+    if (b->context)
+        HG_Context_destroy(b->context);
+    if (b->hg_class)
+        HG_Finalize(b->hg_class);
+}
+
+static int
+hg_serve(const char *transport, const struct bench_opts *opts, int fd)
+{
+    struct hg_bench b;
+    char addr_str[BENCH_ADDR_MAX];
+    hg_size_t addr_len = sizeof(addr_str);
+    hg_addr_t self;
+
+    (void) opts;
+    if (hg_bench_init(&b, transport, HG_TRUE) < 0)
+        return -1;
+    HG_Addr_self(b.hg_class, &self);
+    HG_Addr_to_string(b.hg_class, addr_str, &addr_len, self);
+    HG_Addr_free(b.hg_class, self);
+    if (write(fd, addr_str, strlen(addr_str) + 1) < 0)
+        return -1;
+    close(fd);
+
+    hg_bench_progress(&b, &b.done, 1);
+    hg_bench_finalize(&b);
+    return 0;
+}
+
+static hg_return_t
+hg_forward_cb(const struct hg_cb_info *info)
+{
+    struct hg_bench *b = info->arg;
+    hg_handle_t handle = info->info.forward.handle;
+
+    if (info->ret != HG_SUCCESS) {
+        b->failed = 1;
+        return HG_SUCCESS;
+    }
+    b->completed++;
+    /* Keep the same number of RPCs in flight until the target is issued. */
+    if (b->issued < b->target) {
+        b->issued++;
+        if (HG_Forward(handle, hg_forward_cb, b, NULL) != HG_SUCCESS)
+            b->failed = 1;
+    } else
+        HG_Destroy(handle);
+    return HG_SUCCESS;
+}
+
+static int
+hg_run_rpc(struct hg_bench *b, int concurrency, int iterations)
+{
+    int i;
+
+    b->completed = 0;
+    b->issued = 0;
+    b->target = iterations;
+    for (i = 0; i < concurrency && i < iterations; i++) {
+        hg_handle_t handle;
+
+        if (HG_Create(b->context, b->addr, b->noop_id, &handle) != HG_SUCCESS)
+            return -1;
+        b->issued++;
+        if (HG_Forward(handle, hg_forward_cb, b, NULL) != HG_SUCCESS)
+            return -1;
+    }
+    return hg_bench_progress(b, &b->completed, iterations);
+}
+
+static hg_return_t
+hg_bulk_forward_cb(const struct hg_cb_info *info)
+{
+    struct hg_bench *b = info->arg;
+
+    if (info->ret != HG_SUCCESS)
+        b->failed = 1;
+    b->completed++;
+    return HG_SUCCESS;
+}
+
+static int
+hg_run_bulk(struct hg_bench *b, hg_bulk_t bulk, size_t size, int iterations)
+{
+    hg_handle_t handle;
+    int i;
+
+    if (HG_Create(b->context, b->addr, b->bulk_id, &handle) != HG_SUCCESS)
+        return -1;
+    b->bulk_in.bulk = bulk;
+    b->bulk_in.size = size;
+    b->completed = 0;
+    for (i = 0; i < iterations; i++) {
+        if (HG_Forward(handle, hg_bulk_forward_cb, b, &b->bulk_in) !=
+            HG_SUCCESS)
+            break;
+        if (hg_bench_progress(b, &b->completed, i + 1) < 0)
+            break;
+    }
+    HG_Destroy(handle);
+    return i == iterations ? 0 : -1;
+}
+
+static int
+hg_bench(const char *transport, const char *server_addr,
+    const struct bench_opts *opts)
+{
+    struct hg_bench b;
+    char op[32];
+    hg_size_t max = BENCH_BULK_MAX;
+    void *buf = NULL;
+    hg_bulk_t bulk = HG_BULK_NULL;
+    hg_handle_t handle;
+    size_t size;
+    double start;
+    int rc = -1;
+
+    if (hg_bench_init(&b, transport, HG_FALSE) < 0)
+        goto out;
+    if (HG_Addr_lookup2(b.hg_class, server_addr, &b.addr) != HG_SUCCESS)
+        goto out;
+
+    start = bench_now();
+    if (hg_run_rpc(&b, 1, opts->iterations) < 0)
+        goto out;
+    bench_row("hg", transport, "rpc", 0, opts->iterations, bench_now() - start);
+
+    snprintf(op, sizeof(op), "rpc-c%d", opts->concurrency);
+    start = bench_now();
+    if (hg_run_rpc(&b, opts->concurrency, opts->iterations) < 0)
+        goto out;
+    bench_row("hg", transport, op, 0, opts->iterations, bench_now() - start);
+
+    buf = calloc(1, max);
+    HG_Bulk_create(b.hg_class, 1, &buf, &max, HG_BULK_READ_ONLY, &bulk);
+    for (size = BENCH_BULK_MIN; size <= BENCH_BULK_MAX; size *= 4) {
+        start = bench_now();
+        if (hg_run_bulk(&b, bulk, size, opts->iterations) < 0)
+            goto out;
+        bench_row("hg", transport, "bulk", size, opts->iterations,
+            bench_now() - start);
+    }
+    rc = 0;
+
+out:
+    if (b.addr) {
+        b.completed = 0;
+        if (HG_Create(b.context, b.addr, b.shutdown_id, &handle) ==
+            HG_SUCCESS) {
+            if (HG_Forward(handle, hg_bulk_forward_cb, &b, NULL) ==
+                HG_SUCCESS)
+                hg_bench_progress(&b, &b.completed, 1);
+            HG_Destroy(handle);
+        }
+        HG_Addr_free(b.hg_class, b.addr);
+    }
+    if (bulk != HG_BULK_NULL)
+        HG_Bulk_free(bulk);
+    free(buf);
+    hg_bench_finalize(&b);
+    return rc;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Margo layer                                                               */
+/*---------------------------------------------------------------------------*/
+
+static void
+margo_noop_ult(hg_handle_t handle)
+{
+    margo_respond(handle, NULL);
+    margo_destroy(handle);
+}
+DEFINE_MARGO_RPC_HANDLER(margo_noop_ult)
+
+static void
+margo_bulk_ult(hg_handle_t handle)
+{
+    margo_instance_id mid = margo_hg_handle_get_instance(handle);
+    const struct hg_info *info = margo_get_info(handle);
+    bench_bulk_in_t in;
+    hg_bulk_t local;
+    hg_size_t size;
+    void *buf;
+
+    margo_get_input(handle, &in);
+    size = in.size;
+    buf = malloc(size);
+    margo_bulk_create(mid, 1, &buf, &size, HG_BULK_WRITE_ONLY, &local);
+    margo_bulk_transfer(mid, HG_BULK_PULL, info->addr, in.bulk, 0, local, 0,
+        size);
+    margo_bulk_free(local);
+    free(buf);
+    margo_free_input(handle, &in);
+    margo_respond(handle, NULL);
+    margo_destroy(handle);
+}
+DEFINE_MARGO_RPC_HANDLER(margo_bulk_ult)
+
+static void
+margo_bench_register(margo_instance_id mid, hg_id_t *noop_id, hg_id_t *bulk_id)
+{
+    *noop_id = MARGO_REGISTER(mid, "bench_noop", void, void, margo_noop_ult);
+    *bulk_id = MARGO_REGISTER(
+        mid, "bench_bulk", bench_bulk_in_t, void, margo_bulk_ult);
+}
+
+static int
+margo_serve(const char *transport, const struct bench_opts *opts, int fd)
+{
+    margo_instance_id mid;
+    char addr_str[BENCH_ADDR_MAX];
+    hg_size_t addr_len = sizeof(addr_str);
+    hg_id_t noop_id, bulk_id;
+    hg_addr_t self;
+
+    /* With no handler xstreams, handlers run in the progress loop. */
+    mid = margo_init(transport, MARGO_SERVER_MODE, opts->xstreams > 0,
+        opts->xstreams > 0 ? opts->xstreams : 0);
+    if (mid == MARGO_INSTANCE_NULL)
+        return -1;
+    margo_bench_register(mid, &noop_id, &bulk_id);
+    margo_enable_remote_shutdown(mid);
+
+    margo_addr_self(mid, &self);
+    margo_addr_to_string(mid, addr_str, &addr_len, self);
+    margo_addr_free(mid, self);
+    if (write(fd, addr_str, strlen(addr_str) + 1) < 0)
+        return -1;
+    close(fd);
+
+    margo_wait_for_finalize(mid);
+    return 0;
+}
+
+static int
+margo_run_rpc(margo_instance_id mid, hg_addr_t addr, hg_id_t id,
+    int concurrency, int iterations)
+{
+    hg_handle_t *handles = calloc(concurrency, sizeof(*handles));
+    margo_request *reqs = calloc(concurrency, sizeof(*reqs));
+    int i, rc = 0;
+
+    for (i = 0; i < concurrency; i++)
+        margo_create(mid, addr, id, &handles[i]);
+
+    /* Keep the same number of RPCs in flight, reissuing round-robin. */
+    for (i = 0; i < iterations + concurrency && rc == 0; i++) {
+        int slot = i % concurrency;
+
+        if (i >= concurrency && margo_wait(reqs[slot]) != HG_SUCCESS)
+            rc = -1;
+        if (i < iterations && rc == 0 &&
+            margo_iforward(handles[slot], NULL, &reqs[slot]) != HG_SUCCESS)
+            rc = -1;
+    }
+
+    for (i = 0; i < concurrency; i++)
+        margo_destroy(handles[i]);
+    free(reqs);
+    free(handles);
+    return rc;
+}
+
+static int
+margo_bench(const char *transport, const char *server_addr,
+    const struct bench_opts *opts)
+{
+    margo_instance_id mid;
+    hg_id_t noop_id, bulk_id;
+    hg_addr_t addr = HG_ADDR_NULL;
+    hg_handle_t handle = HG_HANDLE_NULL;
+    hg_bulk_t bulk = HG_BULK_NULL;
+    hg_size_t max = BENCH_BULK_MAX;
+    bench_bulk_in_t in;
+    char layer[32], op[32];
+    void *buf = NULL;
+    size_t size;
+    double start;
+    int i, rc = -1;
+
+    if (opts->xstreams > 0)
+        snprintf(layer, sizeof(layer), "margo-x%d", opts->xstreams);
+    else
+        snprintf(layer, sizeof(layer), "margo");
+
+    mid = margo_init(transport, MARGO_CLIENT_MODE, 0, 0);
+    if (mid == MARGO_INSTANCE_NULL)
+        return -1;
+    margo_bench_register(mid, &noop_id, &bulk_id);
+    if (margo_addr_lookup(mid, server_addr, &addr) != HG_SUCCESS)
+        goto out;
+
+    start = bench_now();
+    if (margo_run_rpc(mid, addr, noop_id, 1, opts->iterations) < 0)
+        goto out;
+    bench_row(layer, transport, "rpc", 0, opts->iterations,
+        bench_now() - start);
+
+    snprintf(op, sizeof(op), "rpc-c%d", opts->concurrency);
+    start = bench_now();
+    if (margo_run_rpc(mid, addr, noop_id, opts->concurrency,
+            opts->iterations) < 0)
+        goto out;
+    bench_row(layer, transport, op, 0, opts->iterations, bench_now() - start);
+
+    buf = calloc(1, max);
+    margo_bulk_create(mid, 1, &buf, &max, HG_BULK_READ_ONLY, &bulk);
+    margo_create(mid, addr, bulk_id, &handle);
+    in.bulk = bulk;
+    for (size = BENCH_BULK_MIN; size <= BENCH_BULK_MAX; size *= 4) {
+        in.size = size;
+        start = bench_now();
+        for (i = 0; i < opts->iterations; i++)
+            if (margo_forward(handle, &in) != HG_SUCCESS)
+                goto out;
+        bench_row(layer, transport, "bulk", size, opts->iterations,
+            bench_now() - start);
+    }
+    rc = 0;
+
+out:
+    if (handle != HG_HANDLE_NULL)
+        margo_destroy(handle);
+    if (bulk != HG_BULK_NULL)
+        margo_bulk_free(bulk);
+    free(buf);
+    if (addr != HG_ADDR_NULL) {
+        margo_shutdown_remote_instance(mid, addr);
+        margo_addr_free(mid, addr);
+    }
+    margo_finalize(mid);
+    return rc;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static int
+bench_transport(const char *transport, const struct bench_opts *opts)
+{
+    int is_hg = strcmp(opts->layer, "hg") == 0;
+    char addr[BENCH_ADDR_MAX];
+    ssize_t len, got = 0;
+    int fds[2], status, rc;
+    pid_t pid;
+
+    if (pipe(fds) < 0)
+        return -1;
+    fflush(stdout);
+
+    /* The server gets its own process, so that both sides use the transport
+     * the same way GekkoFS clients and daemons do. */
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        /* Do not outlive a client that dies before shutting us down. */
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        close(fds[0]);
+        rc = is_hg ? hg_serve(transport, opts, fds[1])
+                   : margo_serve(transport, opts, fds[1]);
+        _exit(rc == 0 ? 0 : 1);
+    }
+
+    close(fds[1]);
+    while ((len = read(fds[0], addr + got, sizeof(addr) - got)) > 0)
+        got += len;
+    close(fds[0]);
+    if (got == 0 || addr[got - 1] != '\0') {
+        fprintf(stderr, "bench-rpc: %s server failed to start on %s\n",
+            opts->layer, transport);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+
+    rc = is_hg ? hg_bench(transport, addr, opts)
+               : margo_bench(transport, addr, opts);
+    if (rc < 0) {
+        fprintf(stderr, "bench-rpc: %s benchmark failed on %s\n", opts->layer,
+            transport);
+        kill(pid, SIGKILL);
+    }
+    waitpid(pid, &status, 0);
+    return rc;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-l hg|margo] [-x handler_xstreams] [-c concurrency]\n"
+        "          [-I iterations] [transport ...]\n",
+        prog);
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct bench_opts opts = {"margo", 0, 16, 1000};
+    const char *defaults[] = {"na+sm", "ofi+tcp"};
+    int opt, i, failed = 0;
+
+    while ((opt = getopt(argc, argv, "l:x:c:I:")) != -1) {
+        switch (opt) {
+            case 'l':
+                opts.layer = optarg;
+                break;
+            case 'x':
+                opts.xstreams = atoi(optarg);
+                break;
+            case 'c':
+                opts.concurrency = atoi(optarg);
+                break;
+            case 'I':
+                opts.iterations = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if ((strcmp(opts.layer, "hg") && strcmp(opts.layer, "margo")) ||
+        opts.xstreams < 0 || opts.concurrency < 1 || opts.iterations < 1)
+        usage(argv[0]);
+
+    printf("layer,provider,endpoint,bytes,iterations,usec_per_xfer,"
+           "mb_per_sec\n");
+    if (optind == argc) {
+        for (i = 0; i < 2; i++)
+            failed |= bench_transport(defaults[i], &opts) < 0;
+    } else {
+        for (i = optind; i < argc; i++)
+            failed |= bench_transport(argv[i], &opts) < 0;
+    }
+
+    return failed ? 1 : 0;
+}